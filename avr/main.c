@@ -24,6 +24,7 @@
 #include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <inttypes.h>
 
 #define LED_ON      PORTB |=  (1 << PB0)
@@ -86,6 +87,30 @@
 //                                             |<--------->|*N
 // MOSI | CMD (0x05) | ~CMD (0xfa) | N | X | Y | R | G | B |      0   |
 // MISO |  0         |   0         | 0 | 0 | 0 | 0 | 0 | 0 | Ack/Nack |
+// 6) SmallEmpty (Does nothing, the host uses it to check we are listening)
+// MOSI | CMD (0x06) | ~CMD (0xf9) |     0    |
+// MISO |  0         |   0         | Ack/Nack |
+// 7) SetGamma (Load N entries of the gamma table, starting at index S)
+//                                             |<->|*N
+// MOSI | CMD (0x07) | ~CMD (0xf8) | S | N | V |      0   |
+// MISO |  0         |   0         | 0 | 0 | 0 | Ack/Nack |
+// 8) SetBrightness (Set the global brightness, 0xff is full brightness)
+// MOSI | CMD (0x08) | ~CMD (0xf7) | L |     0    |
+// MISO |  0         |   0         | 0 | Ack/Nack |
+//
+// 9) Save (Snapshot the LED values, gamma table and brightness to EEPROM,
+//    restored at power on)
+// MOSI | CMD (0x09) | ~CMD (0xf6) |     0    |
+// MISO |  0         |   0         | Ack/Nack |
+//
+// The gamma table and brightness are applied when the LED string is updated,
+// led_data always holds the colours as they were sent.
+//
+// The snapshot is written to EEPROM a byte at a time from the main loop so
+// SPI keeps being serviced, it takes around 1.5S to complete. The snapshot is
+// only marked valid once every byte has been written. Programming does a chip
+// erase, the snapshot only survives that when the EESAVE fuse is programmed
+// (see 'make fuse').
 
 #define SPI_CMD_NULL            0
 #define SPI_CMD_CLEAR           1
@@ -94,6 +119,9 @@
 #define SPI_CMD_SETPIXEL        4
 #define SPI_CMD_SETNPIXELS      5
 #define SPI_CMD_SMALL_EMPTY     6 // A test command
+#define SPI_CMD_SETGAMMA        7
+#define SPI_CMD_SETBRIGHTNESS   8
+#define SPI_CMD_SAVE            9
 #define SPI_RESPONSE_ACK        0x55
 #define SPI_RESPONSE_NACK_HEAD  0xaa
 #define SPI_RESPONSE_NACK_TAIL  0xab
@@ -120,6 +148,14 @@ typedef enum{
 #define LED_COUNT       (LEDS_WIDE * LEDS_HIGH)
 #define LED_DATA_SIZE   (BYTES_PER_LED * LED_COUNT)
 
+#define LUT_SIZE        256
+#define GAMMA_MAX_CHUNK 64 // Max gamma entries in one SetGamma command
+
+#define EE_SNAPSHOT_VALID   0xa6
+#define SNAPSHOT_SIZE       sizeof(t_snapshot)
+#define SNAPSHOT_IDLE       0xffff
+#define HEARTBEAT_MS    250
+
 typedef struct
 {
     uint8_t g;
@@ -127,7 +163,32 @@ typedef struct
     uint8_t b;
 }t_pixel;
 
+// What the Save command writes to EEPROM.
+typedef struct
+{
+    char led_data[LED_DATA_SIZE];
+    uint8_t gamma_lut[LUT_SIZE];
+    uint8_t brightness;
+}t_snapshot;
+
+// leds.S
+void asm_send_led_data(char* data);
+
 volatile char led_data[LED_DATA_SIZE];
+// What is actually sent to the LED string, led_data passed through out_lut.
+static char out_data[LED_DATA_SIZE];
+static uint8_t gamma_lut[LUT_SIZE];
+// gamma_lut combined with the brightness, rebuilt at update time when dirty.
+static uint8_t out_lut[LUT_SIZE];
+static uint8_t brightness = 0xff;
+static uint8_t out_lut_dirty = 1;
+// Copy taken by the Save command while it is written to EEPROM.
+static t_snapshot snapshot;
+// 0 invalidates the saved snapshot, 1..SNAPSHOT_SIZE write the data and
+// SNAPSHOT_SIZE+1 marks it valid.
+static uint16_t snapshot_pos = SNAPSHOT_IDLE;
+EEMEM uint8_t ee_snapshot_valid;
+EEMEM t_snapshot ee_snapshot;
 static volatile uint8_t spi_byte_count = 0;
 static volatile uint8_t last_spi_byte = 0;
 static uint8_t processed_byte_count = 0;
@@ -151,6 +212,42 @@ void init(void)
     CLKPR = 0x0; //clk_io = F_CPU (no scaling)
 }
 
+void lut_init(void)
+{
+    uint16_t i;
+
+    // Linear until the host loads a gamma table.
+    for(i=0; i<LUT_SIZE; i++)
+        gamma_lut[i] = i;
+
+    out_lut_dirty = 1;
+}
+
+// Rebuild out_lut from the gamma table and the brightness. Brightness is
+// applied before the gamma table so dimming follows the corrected curve.
+void lut_rebuild(void)
+{
+    uint16_t i;
+    uint16_t scale = (uint16_t)brightness + 1;
+
+    for(i=0; i<LUT_SIZE; i++)
+        out_lut[i] = gamma_lut[(i * scale) >> 8];
+
+    out_lut_dirty = 0;
+}
+
+// Fill out_data with led_data passed through the lookup table.
+void lut_apply(void)
+{
+    uint8_t i;
+
+    if(out_lut_dirty)
+        lut_rebuild();
+
+    for(i=0; i<LED_DATA_SIZE; i++)
+        out_data[i] = out_lut[(uint8_t)led_data[i]];
+}
+
 // 1mS timer
 // 20Mhz, /1024, *20.
 void timer_init(void)
@@ -300,6 +397,104 @@ e_cmd_ret led_cmd_set_pixel(uint8_t next_byte, uint8_t following)
     return e_error;
 }
 
+e_cmd_ret led_cmd_set_gamma(uint8_t next_byte, uint8_t following)
+{
+    static uint8_t start = 0, count = 0;
+
+    switch(following)
+    {
+        case 0:
+            start = next_byte;
+            return e_processing;
+        case 1:
+            count = next_byte;
+            if((count == 0) || (count > GAMMA_MAX_CHUNK))
+                return e_error;
+            return e_processing;
+    }
+
+    // Wraps at the end of the table
+    gamma_lut[(uint8_t)(start + following - 2)] = next_byte;
+    out_lut_dirty = 1;
+
+    if((following - 1) == count)
+        return e_complete;
+
+    return e_processing;
+}
+
+e_cmd_ret led_cmd_set_brightness(uint8_t next_byte, uint8_t following)
+{
+    brightness = next_byte;
+    out_lut_dirty = 1;
+    return e_complete;
+}
+
+e_cmd_ret led_cmd_save(void)
+{
+    uint16_t i;
+
+    for(i=0; i<LED_DATA_SIZE; i++)
+        snapshot.led_data[i] = led_data[i];
+    for(i=0; i<LUT_SIZE; i++)
+        snapshot.gamma_lut[i] = gamma_lut[i];
+    snapshot.brightness = brightness;
+
+    // A save already in progress starts again with the new data.
+    snapshot_pos = 0;
+    return e_complete;
+}
+
+// Write the next byte of the snapshot if the EEPROM is free, never waits.
+void snapshot_step(void)
+{
+    uint8_t* addr;
+    uint8_t value;
+
+    if((snapshot_pos == SNAPSHOT_IDLE) || !eeprom_is_ready())
+        return;
+
+    if(snapshot_pos == 0)
+    {
+        addr = &ee_snapshot_valid;
+        value = 0xff;
+    }
+    else if(snapshot_pos <= SNAPSHOT_SIZE)
+    {
+        addr = (uint8_t*)&ee_snapshot + (snapshot_pos - 1);
+        value = ((uint8_t*)&snapshot)[snapshot_pos - 1];
+    }
+    else
+    {
+        addr = &ee_snapshot_valid;
+        value = EE_SNAPSHOT_VALID;
+    }
+
+    // The EEPROM write sequence mustn't be interrupted.
+    cli();
+    eeprom_update_byte(addr, value);
+    sei();
+
+    if(snapshot_pos > SNAPSHOT_SIZE)
+        snapshot_pos = SNAPSHOT_IDLE;
+    else
+        snapshot_pos++;
+}
+
+// Restore and show the snapshot saved in EEPROM, if there is one.
+void snapshot_restore(void)
+{
+    if(eeprom_read_byte(&ee_snapshot_valid) != EE_SNAPSHOT_VALID)
+        return;
+
+    eeprom_read_block((void*)led_data, ee_snapshot.led_data, LED_DATA_SIZE);
+    eeprom_read_block(gamma_lut, ee_snapshot.gamma_lut, LUT_SIZE);
+    brightness = eeprom_read_byte(&ee_snapshot.brightness);
+    out_lut_dirty = 1;
+    lut_apply();
+    asm_send_led_data(out_data);
+}
+
 volatile uint8_t ms_count = 0;
 
 ISR (TIMER0_COMPA_vect, ISR_BLOCK)
@@ -312,16 +507,22 @@ void spi_slave_command_state_machine_loop(void)
     uint8_t after_cmd_count = 0;
     e_cmd_ret ret;
     uint8_t last_byte_time = ms_count;
-
-    LED_ON;
-    _delay_ms(1000);
-    LED_OFF;
+    uint8_t last_beat_time = ms_count;
 
     //Global enable interrupts
     sei();
 
     while(1)
     {
+        // Heartbeat, shows the loop is running without holding off SPI.
+        if((uint8_t)(ms_count - last_beat_time) >= HEARTBEAT_MS)
+        {
+            last_beat_time = ms_count;
+            LED_TOGGLE;
+        }
+
+        snapshot_step();
+
         // Polled SPI
         if(SPSR & (1 << SPIF))
         {
@@ -385,6 +586,15 @@ void spi_slave_command_state_machine_loop(void)
                             case SPI_CMD_SMALL_EMPTY:
                                 ret = led_cmd_small_empty();
                                 break;
+                            case SPI_CMD_SETGAMMA:
+                                ret = led_cmd_set_gamma(last_spi_byte, after_cmd_count);
+                                break;
+                            case SPI_CMD_SETBRIGHTNESS:
+                                ret = led_cmd_set_brightness(last_spi_byte, after_cmd_count);
+                                break;
+                            case SPI_CMD_SAVE:
+                                ret = led_cmd_save();
+                                break;
                             //case SPI_CMD_SETNPIXELS: break;
                             default:
                                 ret = e_error;
@@ -424,9 +634,10 @@ void spi_slave_command_state_machine_loop(void)
 
             if(update_pending)
             {
+                lut_apply();
                 // Clear interrupts when sending LED data.
                 cli();
-                asm_send_led_data(led_data);
+                asm_send_led_data(out_data);
                 // re-enable interrupts
                 sei();
                 update_pending = 0;
@@ -438,6 +649,8 @@ void spi_slave_command_state_machine_loop(void)
 int main(void)
 {
     init();
+    lut_init();
+    snapshot_restore();
     spi_slave_init();
     timer_init();
     spi_slave_command_state_machine_loop();
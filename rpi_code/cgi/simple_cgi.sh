@@ -10,8 +10,46 @@ echo "REMOTE_ADDR $REMOTE_ADDR"
 
 ARGS_STR=`echo $QUERY_STRING | tr "+" " "`
 
-echo "/home/pi/spidev_led_matrix $ARGS_STR" &>> /tmp/spidev_led_matrix_web_access.log &
-/home/pi/spidev_led_matrix $ARGS_STR &>> /tmp/spidev_led_matrix_web_access.log &
+# Only pass on the options the page sends, anything else (e.g. -r or -p with
+# a path, or -e which wears the EEPROM) is rejected.
+set -f
+ARGS=($ARGS_STR)
+HEX="0x[0-9a-fA-F]{1,2}"
+i=0
+while [ $i -lt ${#ARGS[@]} ]
+do
+    case "${ARGS[$i]}" in
+        -c|-u)
+            ;;
+        -s)
+            i=$((i + 1))
+            [[ "${ARGS[$i]}" =~ ^[0-9]{1,3}:[0-9]{1,3}:$HEX:$HEX:$HEX$ ]] || ARGS_BAD=1
+            ;;
+        -f)
+            i=$((i + 1))
+            [[ "${ARGS[$i]}" =~ ^$HEX:$HEX:$HEX$ ]] || ARGS_BAD=1
+            ;;
+        *)
+            ARGS_BAD=1
+            ;;
+    esac
+    i=$((i + 1))
+done
+
+if [ -n "$ARGS_BAD" ]
+then
+    echo "<br>"
+    echo "rejected"
+    echo "rejected: $QUERY_STRING" &>> /tmp/spidev_led_matrix_web_access.log
+    exit 0
+fi
+
+# A request can carry a whole batch of pixels (-s x:y:0xrr:0xgg:0xbb repeated
+# with a single -u). Runs are serialised on a lock so requests can't interleave
+# on the SPI bus, and the request only completes once the batch has been sent
+# which stops the page queueing more than it can draw.
+echo "/home/pi/spidev_led_matrix ${ARGS[@]}" &>> /tmp/spidev_led_matrix_web_access.log
+flock /tmp/spidev_led_matrix.lock /home/pi/spidev_led_matrix "${ARGS[@]}" &>> /tmp/spidev_led_matrix_web_access.log
 
 echo "<pre>"
 ls -l /home/pi
@@ -1,4 +1,14 @@
 
+// Painting state, pixels painted since the last batch was sent are kept in
+// pending_pixels keyed on "x:y" so repainting a cell only sends it once.
+var stroke_active = false;
+var stroke_last_x = 0;
+var stroke_last_y = 0;
+var pending_pixels = {};
+var pending_count = 0;
+var frame_requested = false;
+var batch_in_flight = false;
+
 function send_led_command(str)
 {
     var url="cgi-bin/simple_cgi.sh?"+str;
@@ -43,12 +53,94 @@ function body_onload()
     //alert("body_onload");
     // clear and update
     send_led_command("-c+-u");
+
+    document.addEventListener("pointerup", stroke_end);
+    document.addEventListener("pointercancel", stroke_end);
+}
+
+function led_pointer_down(event, element, x, y)
+{
+    // Primary button only
+    if(event.button != 0)
+    {
+        return;
+    }
+
+    stroke_active = true;
+
+    // Touch pointers are captured by the cell they start on, release it so
+    // the other cells see pointerenter as the stroke moves over them.
+    if(element.hasPointerCapture && element.hasPointerCapture(event.pointerId))
+    {
+        element.releasePointerCapture(event.pointerId);
+    }
+
+    led_click(element, x, y);
+    stroke_last_x = x;
+    stroke_last_y = y;
+}
+
+// Moves are coalesced by the browser so a fast stroke can skip cells, paint
+// the line from the last painted cell to this one to fill any gap.
+function led_pointer_enter(event, element, x, y)
+{
+    var dx, dy, sx, sy, err, e2;
+    var cx = stroke_last_x;
+    var cy = stroke_last_y;
+
+    if(!stroke_active)
+    {
+        return;
+    }
+
+    // The button may have been released outside the window
+    if(!(event.buttons & 1))
+    {
+        stroke_end();
+        return;
+    }
+
+    dx = Math.abs(x - cx);
+    dy = -Math.abs(y - cy);
+    sx = (cx < x) ? 1 : -1;
+    sy = (cy < y) ? 1 : -1;
+    err = dx + dy;
+
+    while(cx != x || cy != y)
+    {
+        e2 = 2 * err;
+        if(e2 >= dy)
+        {
+            err += dy;
+            cx += sx;
+        }
+        if(e2 <= dx)
+        {
+            err += dx;
+            cy += sy;
+        }
+        led_click((cx == x && cy == y) ? element : led_element(cx, cy), cx, cy);
+    }
+
+    stroke_last_x = x;
+    stroke_last_y = y;
+}
+
+function led_element(x, y)
+{
+    return document.getElementsByClassName("led_row")[y].children[x];
+}
+
+function stroke_end()
+{
+    stroke_active = false;
 }
 
 function led_click(element, x, y)
 {
     var hex_color = document.getElementById("colorpicker").value;
     var r, g, b;
+    var key = x + ":" + y;
     //alert("x:" + x + " y: " + y);
 
     element.style.background = hex_color;
@@ -58,7 +150,63 @@ function led_click(element, x, y)
     g = hex_color[3] + hex_color[4];
     b = hex_color[5] + hex_color[6];
 
-    send_led_command("-s+"+x+":"+y+":0x"+r+":0x"+g+":0x"+b+"+-u");
+    if(!(key in pending_pixels))
+    {
+        pending_count++;
+    }
+    pending_pixels[key] = "0x"+r+":0x"+g+":0x"+b;
+
+    schedule_batch();
+}
+
+// At most one batch is sent per animation frame and only one is in flight,
+// anything painted meanwhile is sent once the previous request completes.
+function schedule_batch()
+{
+    if(frame_requested || batch_in_flight || pending_count == 0)
+    {
+        return;
+    }
+
+    frame_requested = true;
+    window.requestAnimationFrame(send_batch);
+}
+
+function send_batch()
+{
+    var str = "";
+    var key;
+    var xhr;
+
+    frame_requested = false;
+
+    if(pending_count == 0)
+    {
+        return;
+    }
+
+    for(key in pending_pixels)
+    {
+        str += "-s+" + key + ":" + pending_pixels[key] + "+";
+    }
+    // A single update for the whole batch
+    str += "-u";
+
+    pending_pixels = {};
+    pending_count = 0;
+    batch_in_flight = true;
+
+    xhr = GetXmlHttpObject();
+    xhr.onreadystatechange = function()
+    {
+        if(xhr.readyState == 4)
+        {
+            batch_in_flight = false;
+            schedule_batch();
+        }
+    };
+    xhr.open("GET", "cgi-bin/simple_cgi.sh?" + str, true);
+    xhr.send(null);
 }
 
 
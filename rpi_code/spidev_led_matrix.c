@@ -27,8 +27,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 
@@ -36,6 +43,8 @@
 
 static int spi_fd = 0;
 static struct spi_ioc_transfer spi_transfer_buffer;
+static int journal_fd = -1;
+static int exit_status = 0;
 
 #define SPI_CMD_NULL            0
 #define SPI_CMD_CLEAR           1
@@ -44,11 +53,39 @@ static struct spi_ioc_transfer spi_transfer_buffer;
 #define SPI_CMD_SETPIXEL        4
 #define SPI_CMD_SETNPIXELS      5
 #define SPI_CMD_SMALL_EMPTY     6 // A test command
+#define SPI_CMD_SETGAMMA        7
+#define SPI_CMD_SETBRIGHTNESS   8
+#define SPI_CMD_SAVE            9
 #define SPI_RESPONSE_ACK        0x55
 #define SPI_RESPONSE_NACK_HEAD  0xaa
 #define SPI_RESPONSE_NACK_TAIL  0xab
 #define SPI_RESPONSE_NACK_UNK   0xac
 
+#define LUT_SIZE        256
+#define GAMMA_MAX_CHUNK 64 // Must match the firmware
+
+#define READY_TIMEOUT_MS    2000
+// The firmware resets its command state machine after around 3mS without a
+// byte (ms_count > last_byte_time + 2), keep the gap between probes well
+// over that so one starting part way through a probe can't stay out of step.
+#define READY_PROBE_GAP_US  5000
+
+// Journal file format
+// ===================
+// | "LEDJ" | version (1 byte) |
+// then one record per SPI transaction:
+// | time in uS (8 bytes, little endian) | len (1 byte) | tx bytes * len |
+// Records from several runs can be appended to the same file, the time is
+// wall clock (CLOCK_REALTIME) so they stay in order. Replay timing is based
+// on the gaps between those times: a gap is capped at JOURNAL_MAX_GAP_US so
+// the idle time between runs doesn't stall a replay, and a negative gap
+// (the clock was stepped back while recording) is treated as zero.
+#define JOURNAL_MAGIC           "LEDJ"
+#define JOURNAL_VERSION         1
+#define JOURNAL_HEADER_SIZE     5
+#define JOURNAL_RECORD_HEAD     9
+#define JOURNAL_MAX_GAP_US      (10 * 1000000ULL)
+
 //#define DEBUG_SPI
 
 static void pabort(const char *s)
@@ -57,10 +94,86 @@ static void pabort(const char *s)
     abort();
 }
 
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static uint64_t time_mono_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Sleep until the given CLOCK_MONOTONIC time in uS.
+static void sleep_until_mono_us(uint64_t due_us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = due_us / 1000000;
+    ts.tv_nsec = (due_us % 1000000) * 1000;
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+void journal_write(uint8_t* tx, uint8_t len)
+{
+    int i;
+    uint64_t t = time_now_us();
+    uint8_t rec[JOURNAL_RECORD_HEAD + 255];
+
+    for(i=0; i<8; i++)
+        rec[i] = (t >> (i*8)) & 0xff;
+    rec[8] = len;
+    memcpy(&rec[JOURNAL_RECORD_HEAD], tx, len);
+
+    // A single write so appends from concurrent runs don't interleave.
+    if(write(journal_fd, rec, JOURNAL_RECORD_HEAD + len) < 0)
+        perror("can't write journal");
+}
+
+void journal_open(const char* path)
+{
+    struct stat st;
+    uint8_t header[JOURNAL_HEADER_SIZE] = {'L', 'E', 'D', 'J', JOURNAL_VERSION};
+
+    if(journal_fd >= 0)
+        close(journal_fd);
+
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(journal_fd < 0)
+    {
+        fprintf(stderr, "can't open journal %s\n", path);
+        return;
+    }
+
+    if((fstat(journal_fd, &st) == 0) && (st.st_size == 0))
+    {
+        if(write(journal_fd, header, sizeof(header)) < 0)
+            perror("can't write journal header");
+    }
+}
+
+void journal_close(void)
+{
+    if(journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = -1;
+}
+
 int spi_trx(uint8_t* tx, uint8_t* rx, uint8_t len)
 {
     int ret;
 
+    if(journal_fd >= 0)
+        journal_write(tx, len);
+
     spi_transfer_buffer.tx_buf = (unsigned long)tx;
     spi_transfer_buffer.rx_buf = (unsigned long)rx;
     spi_transfer_buffer.len = len;
@@ -91,85 +204,554 @@ void dump_spi_buffers(uint8_t* tx, uint8_t* rx, uint8_t len)
     printf("\n");
 }
 
-int led_cmd_clear(void)
+// Command scheduler
+// =================
+// The led_cmd_* functions don't talk to the bus, they queue a command for the
+// SPI worker thread. The queue is a lock-free multi producer single consumer
+// list (Vyukov style), so any thread may submit. Queueing doesn't wake the
+// worker, spi_sched_kick() does, as do spi_submit_wait(), spi_sched_drain()
+// and spi_sched_fini(). So a whole command line is queued before anything is
+// sent and the same command line always gives the same bus traffic (and
+// journal). When woken the worker takes everything queued as one batch and
+// removes the commands that wouldn't change what ends up on the LEDs before
+// sending the rest in order:
+// - Only the last UPDATE in a batch is kept, earlier frames are never shown.
+// - A SETPIXEL is dropped if a later write to the same pixel, or a later FILL
+//   or CLEAR, comes before the next kept UPDATE.
+// - A FILL or CLEAR is dropped if a later FILL or CLEAR replaces it.
+// - A SETBRIGHTNESS is dropped if a later one replaces it.
+// Commands after the last UPDATE are coalesced separately so the frame shown
+// by that UPDATE is unchanged. A SAVE snapshots the LED values as they are
+// when it arrives, so nothing is coalesced across one.
+//
+// The queue only lives as long as the process. The web page runs the tool
+// once per request, so commands from different requests or clients are never
+// coalesced with each other, only the commands within one run.
+#define SPI_CMD_MAX_LEN     (2 + 2 + GAMMA_MAX_CHUNK + 1)
+#define SCHED_MAX_BATCH     256
+
+typedef struct t_spi_cmd
+{
+    _Atomic(struct t_spi_cmd*) next;
+    uint8_t len;                // Zero for a marker that is only signalled
+    uint8_t tx[SPI_CMD_MAX_LEN];
+    int* ack;                   // If set, gets the last byte received
+    sem_t* done;                // If set, posted once the command is sent
+} t_spi_cmd;
+
+typedef struct
+{
+    _Atomic(t_spi_cmd*) head;   // Producers push here
+    t_spi_cmd* tail;            // Only touched by the worker
+    t_spi_cmd stub;
+} t_cmd_queue;
+
+static t_cmd_queue cmd_queue;
+static sem_t sched_wakeup;
+static pthread_t sched_thread;
+static atomic_int sched_stop;
+static uint8_t pixel_covered[256 * 256 / 8];
+
+static void cmd_queue_init(t_cmd_queue* q)
+{
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+static void cmd_queue_push(t_cmd_queue* q, t_spi_cmd* cmd)
+{
+    t_spi_cmd* prev;
+
+    atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, cmd, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+// Returns NULL when empty, or when a producer is part way through a push. In
+// the latter case the producer's wakeup hasn't been posted yet so the worker
+// will come back for it.
+static t_spi_cmd* cmd_queue_pop(t_cmd_queue* q)
+{
+    t_spi_cmd* tail = q->tail;
+    t_spi_cmd* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if(tail == &q->stub)
+    {
+        if(next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if(next != NULL)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    if(tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    cmd_queue_push(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if(next != NULL)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void sched_complete(t_spi_cmd* cmd, int ack)
+{
+    if(cmd->ack)
+        *cmd->ack = ack;
+    if(cmd->done)
+        sem_post(cmd->done);
+    free(cmd);
+}
+
+// Mark the commands in batch[from..to) that are made redundant by later ones
+// in the same range by setting them to NULL. They are completed as acked as
+// their effect is covered by the commands that are sent.
+static void sched_coalesce(t_spi_cmd** batch, int from, int to, int keep_update)
+{
+    int i;
+    int wiped = 0;
+    int brightness_set = 0;
+    int drop;
+    uint16_t xy;
+    t_spi_cmd* cmd;
+
+    memset(pixel_covered, 0, sizeof(pixel_covered));
+
+    for(i=to-1; i>=from; i--)
+    {
+        cmd = batch[i];
+        if(cmd->len == 0)
+            continue;
+
+        drop = 0;
+        switch(cmd->tx[0])
+        {
+            case SPI_CMD_UPDATE:
+                drop = (i != keep_update);
+                break;
+            case SPI_CMD_SETPIXEL:
+                xy = (cmd->tx[3] << 8) | cmd->tx[2];
+                if(wiped || (pixel_covered[xy >> 3] & (1 << (xy & 7))))
+                    drop = 1;
+                else
+                    pixel_covered[xy >> 3] |= (1 << (xy & 7));
+                break;
+            case SPI_CMD_CLEAR:
+            case SPI_CMD_FILL:
+                drop = wiped;
+                wiped = 1;
+                break;
+            case SPI_CMD_SETBRIGHTNESS:
+                drop = brightness_set;
+                brightness_set = 1;
+                break;
+            default:
+                break;
+        }
+
+        if(drop)
+        {
+            sched_complete(cmd, SPI_RESPONSE_ACK);
+            batch[i] = NULL;
+        }
+    }
+}
+
+static int sched_is_barrier(t_spi_cmd* cmd)
+{
+    return (cmd->len != 0) && (cmd->tx[0] == SPI_CMD_SAVE);
+}
+
+// Coalesce batch[from..to), which has no barriers in it.
+static void sched_coalesce_range(t_spi_cmd** batch, int from, int to)
+{
+    int i;
+    int last_update = from - 1;
+
+    for(i=from; i<to; i++)
+    {
+        if((batch[i]->len != 0) && (batch[i]->tx[0] == SPI_CMD_UPDATE))
+            last_update = i;
+    }
+
+    sched_coalesce(batch, from, last_update + 1, last_update);
+    sched_coalesce(batch, last_update + 1, to, -1);
+}
+
+static void sched_send_batch(t_spi_cmd** batch, int count)
 {
+    int i;
     int ret;
+    int from = 0;
+    uint8_t rx[SPI_CMD_MAX_LEN];
+
+    for(i=0; i<=count; i++)
+    {
+        if((i == count) || sched_is_barrier(batch[i]))
+        {
+            sched_coalesce_range(batch, from, i);
+            from = i + 1;
+        }
+    }
+
+    for(i=0; i<count; i++)
+    {
+        if(batch[i] == NULL)
+            continue;
+
+        ret = SPI_RESPONSE_ACK;
+        if(batch[i]->len != 0)
+        {
+            memset(rx, 0xcc, batch[i]->len);
+            ret = spi_trx(batch[i]->tx, rx, batch[i]->len);
+            dump_spi_buffers(batch[i]->tx, rx, batch[i]->len);
+        }
+        sched_complete(batch[i], ret);
+    }
+}
+
+static void* sched_worker(void* arg)
+{
+    t_spi_cmd* batch[SCHED_MAX_BATCH];
+    t_spi_cmd* cmd;
+    int count;
+
+    while(1)
+    {
+        sem_wait(&sched_wakeup);
+
+        // One wakeup sends everything queued, SCHED_MAX_BATCH at a time.
+        do
+        {
+            count = 0;
+            while((count < SCHED_MAX_BATCH) && ((cmd = cmd_queue_pop(&cmd_queue)) != NULL))
+                batch[count++] = cmd;
+
+            if(count)
+                sched_send_batch(batch, count);
+        } while(count == SCHED_MAX_BATCH);
+
+        if(atomic_load(&sched_stop))
+            break;
+    }
+
+    return NULL;
+}
+
+static t_spi_cmd* sched_alloc(uint8_t* tx, uint8_t len)
+{
+    t_spi_cmd* cmd;
+
+    if(len > SPI_CMD_MAX_LEN)
+        return NULL;
+
+    cmd = calloc(1, sizeof(*cmd));
+    if(cmd == NULL)
+        pabort("can't allocate command");
+
+    cmd->len = len;
+    memcpy(cmd->tx, tx, len);
+    return cmd;
+}
+
+// Have the worker send everything queued so far.
+void spi_sched_kick(void)
+{
+    sem_post(&sched_wakeup);
+}
+
+// Queue a command for the worker, returns straight away. It isn't sent until
+// the worker is next kicked.
+int spi_submit(uint8_t* tx, uint8_t len)
+{
+    t_spi_cmd* cmd = sched_alloc(tx, len);
+
+    if(cmd == NULL)
+        return -1;
+
+    cmd_queue_push(&cmd_queue, cmd);
+    return 0;
+}
+
+// Queue a command and wait for it to be sent, returns the ack byte. A zero
+// len waits for everything queued before it without sending anything.
+int spi_submit_wait(uint8_t* tx, uint8_t len)
+{
+    int ack = SPI_RESPONSE_NACK_UNK;
+    sem_t done;
+    t_spi_cmd* cmd = sched_alloc(tx, len);
+
+    if(cmd == NULL)
+        return SPI_RESPONSE_NACK_UNK;
+
+    sem_init(&done, 0, 0);
+    cmd->ack = &ack;
+    cmd->done = &done;
+
+    cmd_queue_push(&cmd_queue, cmd);
+    spi_sched_kick();
+
+    while(sem_wait(&done) != 0)
+        ;
+    sem_destroy(&done);
+
+    return ack;
+}
+
+// Wait until everything queued so far has been sent.
+void spi_sched_drain(void)
+{
+    spi_submit_wait(NULL, 0);
+}
+
+void spi_sched_init(void)
+{
+    cmd_queue_init(&cmd_queue);
+    sem_init(&sched_wakeup, 0, 0);
+    atomic_store(&sched_stop, 0);
+
+    if(pthread_create(&sched_thread, NULL, sched_worker, NULL) != 0)
+        pabort("can't start spi worker");
+}
+
+// Sends anything still queued then stops the worker. Nothing may be
+// submitted once this has been called.
+void spi_sched_fini(void)
+{
+    atomic_store(&sched_stop, 1);
+    spi_sched_kick();
+    pthread_join(sched_thread, NULL);
+    sem_destroy(&sched_wakeup);
+}
+
+int led_cmd_clear(void)
+{
     uint8_t tx[] = {
         SPI_CMD_CLEAR,
         (SPI_CMD_CLEAR ^ 0xff),
         0,
         0};
-    uint8_t rx[ARRAY_SIZE(tx)];
-    memset(rx, 0xcc, ARRAY_SIZE(rx));
 
-    ret = spi_trx(tx, rx, ARRAY_SIZE(tx));
-    dump_spi_buffers(tx, rx, ARRAY_SIZE(tx));
-    return ret;
+    return spi_submit(tx, ARRAY_SIZE(tx));
 }
 
 int led_cmd_fill(uint8_t r, uint8_t g, uint8_t b)
 {
-    int ret;
     uint8_t tx[] = {
         SPI_CMD_FILL,
         (SPI_CMD_FILL ^ 0xff),
         r,g,b,
         0};
-    uint8_t rx[ARRAY_SIZE(tx)];
-    memset(rx, 0xcc, ARRAY_SIZE(rx));
 
-    ret = spi_trx(tx, rx, ARRAY_SIZE(tx));
-    dump_spi_buffers(tx, rx, ARRAY_SIZE(tx));
-    return ret;
+    return spi_submit(tx, ARRAY_SIZE(tx));
 }
 
 int led_cmd_update(void)
 {
-    int ret;
     uint8_t tx[] = {
         SPI_CMD_UPDATE,
         (SPI_CMD_UPDATE ^ 0xff),
         0,
         0};
-    uint8_t rx[ARRAY_SIZE(tx)];
-    memset(rx, 0xcc, ARRAY_SIZE(rx));
-
-    ret = spi_trx(tx, rx, ARRAY_SIZE(tx));
-    dump_spi_buffers(tx, rx, ARRAY_SIZE(tx));
-    return ret;
 
+    return spi_submit(tx, ARRAY_SIZE(tx));
 }
 
 int led_cmd_set_pixel(uint8_t x, uint8_t y, uint8_t r, uint8_t g, uint8_t b)
 {
-    int ret;
     uint8_t tx[] = {
         SPI_CMD_SETPIXEL,
         (SPI_CMD_SETPIXEL ^ 0xff),
         x, y, r, g, b,
         0};
-    uint8_t rx[ARRAY_SIZE(tx)];
-    memset(rx, 0xcc, ARRAY_SIZE(rx));
 
-    ret = spi_trx(tx, rx, ARRAY_SIZE(tx));
-    dump_spi_buffers(tx, rx, ARRAY_SIZE(tx));
-    return ret;
+    return spi_submit(tx, ARRAY_SIZE(tx));
 }
 
+// Waits for the response as this is used to probe the firmware.
 int led_cmd_small_empty(void)
 {
-    int ret;
     uint8_t tx[] = {
         SPI_CMD_SMALL_EMPTY,
         (SPI_CMD_SMALL_EMPTY ^ 0xff),
         0,
         0};
-    uint8_t rx[ARRAY_SIZE(tx)];
-    memset(rx, 0xcc, ARRAY_SIZE(rx));
 
-    ret = spi_trx(tx, rx, ARRAY_SIZE(tx));
-    dump_spi_buffers(tx, rx, ARRAY_SIZE(tx));
-    return ret;
+    return spi_submit_wait(tx, ARRAY_SIZE(tx));
+}
+
+int led_cmd_save(void)
+{
+    uint8_t tx[] = {
+        SPI_CMD_SAVE,
+        (SPI_CMD_SAVE ^ 0xff),
+        0,
+        0};
+
+    return spi_submit(tx, ARRAY_SIZE(tx));
+}
+
+int led_cmd_set_gamma(uint8_t start, uint8_t count, uint8_t* values)
+{
+    uint8_t tx[SPI_CMD_MAX_LEN];
+    uint8_t len = 2 + 2 + count + 1;
+
+    if((count == 0) || (count > GAMMA_MAX_CHUNK))
+        return -1;
+
+    tx[0] = SPI_CMD_SETGAMMA;
+    tx[1] = (SPI_CMD_SETGAMMA ^ 0xff);
+    tx[2] = start;
+    tx[3] = count;
+    memcpy(&tx[4], values, count);
+    tx[len-1] = 0;
+
+    return spi_submit(tx, len);
+}
+
+int led_cmd_set_brightness(uint8_t level)
+{
+    uint8_t tx[] = {
+        SPI_CMD_SETBRIGHTNESS,
+        (SPI_CMD_SETBRIGHTNESS ^ 0xff),
+        level,
+        0};
+
+    return spi_submit(tx, ARRAY_SIZE(tx));
+}
+
+// Probe with SMALL_EMPTY until the firmware acks, returns the time taken in
+// mS or -1 if it didn't answer within READY_TIMEOUT_MS.
+int wait_ready(void)
+{
+    uint64_t start_us = time_mono_us();
+    uint64_t elapsed_us;
+
+    while(1)
+    {
+        elapsed_us = time_mono_us() - start_us;
+
+        if(led_cmd_small_empty() == SPI_RESPONSE_ACK)
+            return elapsed_us / 1000;
+
+        if(elapsed_us > (READY_TIMEOUT_MS * 1000))
+            return -1;
+
+        usleep(READY_PROBE_GAP_US);
+    }
+}
+
+// Build a gamma table for the given exponent and load it in chunks,
+// 1.0 gives a linear table.
+void load_gamma(double gamma)
+{
+    int i;
+    uint8_t lut[LUT_SIZE];
+
+    for(i=0; i<LUT_SIZE; i++)
+        lut[i] = (uint8_t)(pow(i / 255.0, gamma) * 255.0 + 0.5);
+
+    for(i=0; i<LUT_SIZE; i+=GAMMA_MAX_CHUNK)
+        led_cmd_set_gamma(i, GAMMA_MAX_CHUNK, &lut[i]);
+}
+
+// Re-issue every transaction in a journal. When fast is zero the original
+// gaps between transactions are kept, otherwise they are sent back to back.
+// The journal is replayed as recorded, bypassing the command scheduler.
+void journal_replay(const char* path, int fast)
+{
+    int fd;
+    struct stat st;
+    uint8_t* map;
+    size_t pos = JOURNAL_HEADER_SIZE;
+    uint64_t t, prev_t = 0;
+    uint64_t start_us, end_us, due_us;
+    uint8_t len;
+    uint8_t rx[255];
+    unsigned int count = 0, nacks = 0;
+    int i;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        fprintf(stderr, "can't open journal %s\n", path);
+        return;
+    }
+
+    if((fstat(fd, &st) < 0) || (st.st_size < JOURNAL_HEADER_SIZE))
+    {
+        fprintf(stderr, "journal %s is too short\n", path);
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        pabort("can't mmap journal");
+
+    if((memcmp(map, JOURNAL_MAGIC, 4) != 0) || (map[4] != JOURNAL_VERSION))
+    {
+        fprintf(stderr, "%s is not a journal\n", path);
+        munmap(map, st.st_size);
+        return;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // The worker is idle once drained so spi_trx() can be used directly.
+    spi_sched_drain();
+    start_us = time_mono_us();
+    due_us = start_us;
+
+    while((pos + JOURNAL_RECORD_HEAD) <= (size_t)st.st_size)
+    {
+        t = 0;
+        for(i=0; i<8; i++)
+            t |= (uint64_t)map[pos + i] << (i*8);
+        len = map[pos + 8];
+        pos += JOURNAL_RECORD_HEAD;
+
+        if((len == 0) || ((pos + len) > (size_t)st.st_size))
+        {
+            fprintf(stderr, "journal truncated at offset %zu\n", pos);
+            break;
+        }
+
+        if(!fast && (count != 0) && (t > prev_t))
+        {
+            if((t - prev_t) > JOURNAL_MAX_GAP_US)
+                due_us += JOURNAL_MAX_GAP_US;
+            else
+                due_us += t - prev_t;
+            sleep_until_mono_us(due_us);
+        }
+        prev_t = t;
+
+        // spi_trx() only reads tx so it can point into the read-only mapping
+        if(spi_trx(&map[pos], rx, len) != SPI_RESPONSE_ACK)
+            nacks++;
+
+        pos += len;
+        count++;
+    }
+
+    end_us = time_mono_us();
+    munmap(map, st.st_size);
+
+    printf("replayed %u transactions in %llu uS, %u not acked\n",
+            count, (unsigned long long)(end_us - start_us), nacks);
 }
 
 void spi_init(void)
@@ -241,6 +823,13 @@ void print_usage(void)
             "    -u                     update\n"
             "    -f 0xrr:0xgg:0xbb      fill\n"
             "    -s x:y:0xrr:0xgg:0xbb  set pixel\n"
+            "    -g gamma               load gamma table (e.g. 2.2, 1.0 is linear)\n"
+            "    -b 0xll                brightness (0xff is full)\n"
+            "    -e                     save the frame, gamma and brightness to EEPROM\n"
+            "    -w                     wait for the firmware to be ready\n"
+            "    -r file                record following transactions to a journal\n"
+            "    -p file                replay a journal with its original timing\n"
+            "    -P file                replay a journal as fast as possible\n"
             );
 }
 
@@ -248,11 +837,13 @@ void parse_opts(int argc, char* argv[])
 {
     int ret;
     int processing_args = 1;
-    int r = 0, g = 0, b = 0, x = 0, y = 0;
+    int r = 0, g = 0, b = 0, x = 0, y = 0, l = 0;
+    double gamma = 1.0;
+    int ready_ms;
 
     while(processing_args)
     {
-        ret = getopt(argc, argv, "cuf:s:");
+        ret = getopt(argc, argv, "cuf:s:g:b:r:p:P:ew");
 
         if(ret == -1)
         {
@@ -293,6 +884,59 @@ void parse_opts(int argc, char* argv[])
                     led_cmd_set_pixel(x, y, r, g, b);
                 }
                 break;
+            case 'g':
+                if((1 != sscanf(optarg, "%lf", &gamma)) || (gamma <= 0.0))
+                {
+                    printf("gamma failed to parse (%s)\n", optarg);
+                }
+                else
+                {
+                    printf("gamma %.2f\n", gamma);
+                    load_gamma(gamma);
+                }
+                break;
+            case 'b':
+                if(1 != sscanf(optarg, "0x%2x", &l))
+                {
+                    printf("brightness failed to parse (%s)\n", optarg);
+                }
+                else
+                {
+                    printf("brightness 0x%02x\n", l);
+                    led_cmd_set_brightness(l);
+                }
+                break;
+            case 'e':
+                printf("save\n");
+                led_cmd_save();
+                break;
+            case 'w':
+                ready_ms = wait_ready();
+                if(ready_ms < 0)
+                {
+                    printf("not ready after %d mS\n", READY_TIMEOUT_MS);
+                    exit_status = 1;
+                    // No point sending the rest
+                    processing_args = 0;
+                }
+                else
+                {
+                    printf("ready after %d mS\n", ready_ms);
+                }
+                break;
+            case 'r':
+                printf("record %s\n", optarg);
+                // The worker writes the journal from spi_trx(), let it send
+                // everything queued so far before the fd changes. This also
+                // keeps earlier commands out of the new journal.
+                spi_sched_drain();
+                journal_open(optarg);
+                break;
+            case 'p':
+            case 'P':
+                printf("replay %s\n", optarg);
+                journal_replay(optarg, ret == 'P');
+                break;
             default:
                 print_usage();
                 break;
@@ -303,9 +947,14 @@ void parse_opts(int argc, char* argv[])
 int main(int argc, char *argv[])
 {
     spi_init();
+    spi_sched_init();
     parse_opts(argc, argv);
+    // Sends anything still queued and stops the worker, so it is done with
+    // the journal before it is closed.
+    spi_sched_fini();
+    journal_close();
     spi_fini();
 
-    return 0;
+    return exit_status;
 }
 